@@ -11,6 +11,22 @@ class ExprAST {
     public:
         virtual ~ExprAST() = default;
         virtual llvm::Value *Codegen() = 0;
+    protected:
+        //把自己的子節點搬到 Out 裡（搬完之後自己的子節點就是空的），沒有子節點的就什麼都不做
+        virtual void takeChildren(std::vector<std::unique_ptr<ExprAST>> &/*Out*/) {}
+        //很深的樹如果照預設一層一層解構會把堆疊撐爆，
+        //所以有子節點的類別在解構子裡呼叫這個，先把子孫都拆下來放進 vector 裡，再一個一個釋放
+        void releaseChildren(){
+            std::vector<std::unique_ptr<ExprAST>> Pending;
+            takeChildren(Pending);
+            while(!Pending.empty()){
+                std::unique_ptr<ExprAST> E = std::move(Pending.back());
+                Pending.pop_back();
+                if(E){
+                    E->takeChildren(Pending);
+                }
+            }
+        }
 };
 
 //數字
@@ -18,6 +34,7 @@ class NumberExprAST: public ExprAST {
     double Val;
     public:
         NumberExprAST(double Val) : Val(Val) {}
+        double getVal() const { return Val; }
         llvm::Value *Codegen() override;
 };
 
@@ -38,7 +55,16 @@ class BinaryExprAST: public ExprAST {
     public:
         BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS) 
         : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+        ~BinaryExprAST() override { releaseChildren(); }
+        char getOp() const { return Op; }
+        ExprAST *getLHS() const { return LHS.get(); }
+        ExprAST *getRHS() const { return RHS.get(); }
         llvm::Value *Codegen() override;
+    protected:
+        void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Out) override {
+            Out.push_back(std::move(LHS));
+            Out.push_back(std::move(RHS));
+        }
 };
 
 // 條件if then else
@@ -47,7 +73,42 @@ class IfExprAST: public ExprAST {
     public:
         IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
         : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+        ~IfExprAST() override { releaseChildren(); }
+        ExprAST *getCond() const { return Cond.get(); }
+        ExprAST *getThen() const { return Then.get(); }
+        ExprAST *getElse() const { return Else.get(); }
         llvm::Value *Codegen() override;
+    protected:
+        void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Out) override {
+            Out.push_back(std::move(Cond));
+            Out.push_back(std::move(Then));
+            Out.push_back(std::move(Else));
+        }
+};
+
+// 迴圈 for i = start, end, step in body
+// end 是條件，不是 0 就繼續跑；step 可以省略，預設是 1
+class ForExprAST: public ExprAST {
+    std::string VarName;
+    std::unique_ptr<ExprAST> Start, End, Step, Body;
+    public:
+        ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
+                   std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body)
+        : VarName(VarName), Start(std::move(Start)), End(std::move(End)), Step(std::move(Step)), Body(std::move(Body)) {}
+        ~ForExprAST() override { releaseChildren(); }
+        const std::string &getVarName() const { return VarName; }
+        ExprAST *getStart() const { return Start.get(); }
+        ExprAST *getEnd() const { return End.get(); }
+        ExprAST *getStep() const { return Step.get(); }
+        ExprAST *getBody() const { return Body.get(); }
+        llvm::Value *Codegen() override;
+    protected:
+        void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Out) override {
+            Out.push_back(std::move(Start));
+            Out.push_back(std::move(End));
+            Out.push_back(std::move(Step));
+            Out.push_back(std::move(Body));
+        }
 };
 
 // 把函數塞進去
@@ -57,7 +118,17 @@ class CallExprAST: public ExprAST {
     public:
         CallExprAST(std::string Callee, std::vector<std::unique_ptr<ExprAST>> Args)
         : Callee(Callee), Args(std::move(Args)) {}
+        ~CallExprAST() override { releaseChildren(); }
+        const std::string &getCallee() const { return Callee; }
+        const std::vector<std::unique_ptr<ExprAST>> &getArgs() const { return Args; }
         llvm::Value *Codegen() override;
+    protected:
+        void takeChildren(std::vector<std::unique_ptr<ExprAST>> &Out) override {
+            for(auto &Arg : Args){
+                Out.push_back(std::move(Arg));
+            }
+            Args.clear();
+        }
 };
 
 //函數原型
@@ -67,6 +138,7 @@ class PrototypeAST {
     public:
         PrototypeAST(const std::string Name, std::vector<std::string> Args)
         : Name(Name), Args(std::move(Args)) {}
+        const std::string &getName() const { return Name; }
         llvm::Function *Codegen();
 };
 
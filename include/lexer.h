@@ -15,7 +15,9 @@ enum Token {
     tok_lparen = -9, // (
     tok_rparen = -10, // )
     tok_semicolon = -11, //;
-    tok_comma = -12 //,
+    tok_comma = -12, //,
+    tok_for = -13,
+    tok_in = -14
 };
 
 extern std::string IdentifierStr;
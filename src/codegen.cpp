@@ -5,22 +5,172 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Pass.h>
+#include <llvm/Transforms/Utils.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Vectorize.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_os_ostream.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/Host.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/ADT/StringMap.h>
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
 #include <stdexcept>
 #include <iostream>
+#include <sstream>
 
 static llvm::LLVMContext TheContext;
 static llvm::IRBuilder<> Builder(TheContext);
 static std::unique_ptr<llvm::Module> TheModule;
-static std::map<std::string, llvm::Value *> NamedValues;
+//變數都放在函數 entry 的 alloca 裡，之後交給 mem2reg 變回 SSA
+static std::map<std::string, llvm::AllocaInst *> NamedValues;
+static std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
+static std::unique_ptr<llvm::ExecutionEngine> TheEngine;
+//所有成功定義過的函數原型（整個程式共用，不管在哪個模組），
+//模組換掉之後還能在新模組裡重新宣告，呼叫之前模組裡的函數，也用來檢查函數有沒有重複定義
+static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+//從 prelude.bc 載進來的標準函式庫，還有目前還沒被使用者重新定義掉的 prelude 函數名稱
+static std::unique_ptr<llvm::Module> PreludeModule;
+static std::set<std::string> PreludeNames;
+static std::unique_ptr<llvm::TargetMachine> TheTargetMachine;
 
-void InitializeCodegen(){
+//浮點數模式
+//strict：完全照 IEEE 來，不融合也不重排
+//contract：允許把 a*b+c 融合成 FMA
+//fast：全部的 fast-math 都打開，可以重排、忽略 NaN/Inf
+enum class FPMode { Strict, Contract, Fast };
+static FPMode TheFPMode = FPMode::Strict;
+
+static bool ParseFPMode(const std::string &Str, FPMode &Mode){
+    if(Str == "strict"){
+        Mode = FPMode::Strict;
+    } else if(Str == "contract"){
+        Mode = FPMode::Contract;
+    } else if(Str == "fast"){
+        Mode = FPMode::Fast;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+//把本機的 CPU 特性（AVX2、AVX-512、FMA 之類的）列成 "+avx2"、"+fma"... 的格式
+static std::vector<std::string> GetHostFeatures(){
+    llvm::StringMap<bool> HostFeatures;
+    std::vector<std::string> Features;
+    if(llvm::sys::getHostCPUFeatures(HostFeatures)){
+        for(auto &F : HostFeatures){
+            Features.push_back((F.getValue() ? "+" : "-") + F.getKey().str());
+        }
+    }
+    return Features;
+}
+
+static llvm::TargetOptions GetTargetOptions(){
+    llvm::TargetOptions Opts;
+    switch(TheFPMode){
+        case FPMode::Strict:
+            Opts.AllowFPOpFusion = llvm::FPOpFusion::Strict;
+            break;
+        case FPMode::Contract:
+            Opts.AllowFPOpFusion = llvm::FPOpFusion::Fast;
+            break;
+        case FPMode::Fast:
+            Opts.AllowFPOpFusion = llvm::FPOpFusion::Fast;
+            Opts.UnsafeFPMath = true;
+            Opts.NoInfsFPMath = true;
+            Opts.NoNaNsFPMath = true;
+            Opts.NoSignedZerosFPMath = true;
+            break;
+    }
+    return Opts;
+}
+
+//用本機的 CPU 名稱跟特性建立 TargetMachine，之後每個模組的 triple 跟 data layout 都照它設定
+static void InitializeTargetMachine(){
+    std::string TargetTriple = llvm::sys::getProcessTriple();
+    std::string Error;
+    const llvm::Target *T = llvm::TargetRegistry::lookupTarget(TargetTriple, Error);
+    if(!T){
+        std::cerr << "Codegen Error: " << Error << std::endl;
+        return;
+    }
+
+    std::string CPU = llvm::sys::getHostCPUName().str();
+    std::string Features = llvm::join(GetHostFeatures(), ",");
+    TheTargetMachine.reset(T->createTargetMachine(TargetTriple, CPU, Features, GetTargetOptions(), llvm::None));
+    if(!TheTargetMachine){
+        std::cerr << "Codegen Error: could not create target machine for " << CPU << std::endl;
+    }
+}
+
+//每個函數產生完之後跑的最佳化
+//mem2reg 先把 alloca 變回 SSA，迴圈的歸納變數才會變成 phi，後面的迴圈最佳化才認得出來。
+//接著把迴圈轉成標準形狀（rotate、LICM、indvars），再交給向量化跟展開。
+//向量化要知道目標 CPU 有多寬的向量暫存器，所以要把 TargetMachine 的 TTI 也放進去。
+//浮點數的累加要在 contract/fast 模式下才能重排，strict 模式的迴圈會照原本的順序保持純量。
+static void InitializePassManager(){
+    TheFPM = std::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
+    if(TheTargetMachine){
+        TheFPM->add(llvm::createTargetTransformInfoWrapperPass(TheTargetMachine->getTargetIRAnalysis()));
+    }
+    TheFPM->add(llvm::createPromoteMemoryToRegisterPass());
+    TheFPM->add(llvm::createInstructionCombiningPass());
+    TheFPM->add(llvm::createReassociatePass());
+    TheFPM->add(llvm::createGVNPass());
+    TheFPM->add(llvm::createCFGSimplificationPass());
+
+    TheFPM->add(llvm::createLoopRotatePass());
+    TheFPM->add(llvm::createLICMPass());
+    TheFPM->add(llvm::createIndVarSimplifyPass());
+    TheFPM->add(llvm::createLoopVectorizePass());
+    TheFPM->add(llvm::createLoopUnrollPass());
+    TheFPM->add(llvm::createInstructionCombiningPass());
+    TheFPM->add(llvm::createCFGSimplificationPass());
+    TheFPM->doInitialization();
+}
+
+//開一個新的空模組（連同 pass manager），執行模式每一批表達式都會換一個新模組
+static void InitializeModule(){
     TheModule = std::make_unique<llvm::Module>("RayCompiler", TheContext);
+    if(TheTargetMachine){
+        TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+        TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    }
+    InitializePassManager();
+}
+
+void InitializeCodegen(){
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
+    InitializeTargetMachine();
+    InitializeModule();
 }
 
 static llvm::Value *LogErrorV(const char *Str){
@@ -28,40 +178,26 @@ static llvm::Value *LogErrorV(const char *Str){
     return nullptr;
 }
 
+//在函數的 entry block 最前面開一個 double 的 alloca，這樣 mem2reg 才能處理
+static llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *TheFunction, const std::string &VarName){
+    llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(llvm::Type::getDoubleTy(TheContext), nullptr, VarName);
+}
+
 llvm::Value *NumberExprAST::Codegen(){
     return llvm::ConstantFP::get(TheContext, llvm::APFloat(Val));
 }
 
 llvm::Value *VariableExprAST::Codegen(){
-    llvm::Value *V = NamedValues[Name];
-    if(!V){
+    llvm::AllocaInst *A = NamedValues[Name];
+    if(!A){
         return LogErrorV("Unknown variable name!");
     }
 
-    return V;
+    return Builder.CreateLoad(A->getAllocatedType(), A, Name.c_str());
 }
 
-llvm::Value *BinaryExprAST::Codegen(){
-    if(Op == '='){
-        VariableExprAST *LHSE = dynamic_cast<VariableExprAST*>(LHS.get());
-        if(!LHSE){
-            return LogErrorV("Destination of '=' must be a variable");
-        }
-        llvm::Value *Val = RHS->Codegen();
-        if(!RHS){
-            return nullptr;
-        }
-        NamedValues[LHSE->getName()] = Val;
-        return Val;
-    }
-    
-    llvm::Value *L = LHS->Codegen();
-    llvm::Value *R = RHS->Codegen();
-
-    if(!L || !R){
-        return nullptr;
-    }
-
+static llvm::Value *EmitBinOp(char Op, llvm::Value *L, llvm::Value *R){
     switch(Op){
         case '+':
             return Builder.CreateFAdd(L, R, "addtmp");
@@ -82,69 +218,429 @@ llvm::Value *BinaryExprAST::Codegen(){
     }
 }
 
-llvm::Value *IfExprAST::Codegen(){
-    llvm::Value *CondV = Cond->Codegen();
-    if(!CondV){
-        return nullptr;
+//先在目前的模組找，找不到的話就用之前記下來的原型在這個模組裡宣告一個，
+//prelude 的函數則照 PreludeModule 裡的型別宣告（本體之後由 InlinePreludeCalls 複製進來）
+static llvm::Function *getFunction(const std::string &Name){
+    if(auto *F = TheModule->getFunction(Name)){
+        return F;
+    }
+
+    auto FI = FunctionProtos.find(Name);
+    if(FI != FunctionProtos.end()){
+        return FI->second->Codegen();
+    }
+
+    if(PreludeNames.count(Name)){
+        llvm::Function *PF = PreludeModule->getFunction(Name);
+        return llvm::Function::Create(PF->getFunctionType(), llvm::Function::ExternalLinkage, Name, TheModule.get());
+    }
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------------//
+//表達式的 codegen                                                                    //
+//筆記：整個不用遞迴，自己用一個堆疊（CodegenFrame）做後序走訪。                          //
+//每個有子節點的節點都拆成好幾個階段（Stage），每個階段做完自己的事之後，                    //
+//要嘛說「我需要先算這個子節點」（推一個新的框上去），要嘛說「我算完了，值是這個」。           //
+//子節點算完的值會收進父節點框的 Vals 裡，父節點下一次被叫到的時候就可以用。                  //
+//數字跟變數沒有子節點，直接呼叫它們自己的 Codegen。                                      //
+//---------------------------------------------------------------------------------//
+
+struct CodegenFrame {
+    ExprAST *Node;
+    int Stage = 0;
+    std::vector<llvm::Value *> Vals;
+    llvm::BasicBlock *Blocks[4] = {};
+    llvm::AllocaInst *Alloca = nullptr;
+    llvm::AllocaInst *OldVal = nullptr;
+    llvm::AllocaInst *Counter = nullptr;
+    llvm::Value *TripCount = nullptr;
+    llvm::Function *Callee = nullptr;
+
+    CodegenFrame(ExprAST *Node) : Node(Node) {}
+};
+
+enum StepState { StepError, StepNeedChild, StepDone };
+
+//二元運算：先算左邊再算右邊（賦值的左邊是變數名稱，不用算），最後產生指令
+static StepState StepBinary(BinaryExprAST *E, CodegenFrame &F, ExprAST *&Child, llvm::Value *&Result){
+    switch(F.Stage){
+        case 0:
+            F.Stage = 1;
+            if(E->getOp() == '='){
+                if(!dynamic_cast<VariableExprAST *>(E->getLHS())){
+                    LogErrorV("Destination of '=' must be a variable");
+                    return StepError;
+                }
+            } else {
+                Child = E->getLHS();
+                return StepNeedChild;
+            }
+            [[fallthrough]];
+        case 1:
+            F.Stage = 2;
+            Child = E->getRHS();
+            return StepNeedChild;
+        default: {
+            llvm::Value *R = F.Vals.back();
+            if(E->getOp() == '='){
+                auto *LHSE = static_cast<VariableExprAST *>(E->getLHS());
+                llvm::AllocaInst *&Alloca = NamedValues[LHSE->getName()];
+                if(!Alloca){
+                    Alloca = CreateEntryBlockAlloca(Builder.GetInsertBlock()->getParent(), LHSE->getName());
+                }
+                Builder.CreateStore(R, Alloca);
+                Result = R;
+                return StepDone;
+            }
+            Result = EmitBinOp(E->getOp(), F.Vals.front(), R);
+            return Result ? StepDone : StepError;
+        }
+    }
+}
+
+//if：算條件 -> 開 then/else/ifcont 三個 block -> 算 then -> 算 else -> 用 phi 合起來
+static StepState StepIf(IfExprAST *E, CodegenFrame &F, ExprAST *&Child, llvm::Value *&Result){
+    switch(F.Stage){
+        case 0:
+            F.Stage = 1;
+            Child = E->getCond();
+            return StepNeedChild;
+        case 1: {
+            llvm::Value *CondV = F.Vals[0];
+            if(!CondV->getType()->isDoubleTy()){
+                LogErrorV("Condition must be a double type");
+                return StepError;
+            }
+            CondV = Builder.CreateFCmpONE(CondV, llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)), "ifcond");
+
+            llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+            F.Blocks[0] = llvm::BasicBlock::Create(TheContext, "then", TheFunction);
+            F.Blocks[1] = llvm::BasicBlock::Create(TheContext, "else");
+            F.Blocks[2] = llvm::BasicBlock::Create(TheContext, "ifcont");
+            Builder.CreateCondBr(CondV, F.Blocks[0], F.Blocks[1]);
+
+            Builder.SetInsertPoint(F.Blocks[0]);
+            F.Stage = 2;
+            Child = E->getThen();
+            return StepNeedChild;
+        }
+        case 2: {
+            Builder.CreateBr(F.Blocks[2]);
+            F.Blocks[0] = Builder.GetInsertBlock();
+
+            llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+            F.Blocks[1]->insertInto(TheFunction);
+            Builder.SetInsertPoint(F.Blocks[1]);
+            F.Stage = 3;
+            Child = E->getElse();
+            return StepNeedChild;
+        }
+        default: {
+            Builder.CreateBr(F.Blocks[2]);
+            F.Blocks[1] = Builder.GetInsertBlock();
+
+            llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+            F.Blocks[2]->insertInto(TheFunction);
+            Builder.SetInsertPoint(F.Blocks[2]);
+            llvm::PHINode *PN = Builder.CreatePHI(llvm::Type::getDoubleTy(TheContext), 2, "iftmp");
+            PN->addIncoming(F.Vals[1], F.Blocks[0]);
+            PN->addIncoming(F.Vals[2], F.Blocks[1]);
+            Result = PN;
+            return StepDone;
+        }
     }
-    if(CondV->getType()->isDoubleTy()){
-        return LogErrorV("Condition must be a double type"); 
+}
+
+//把 Root 底下所有被 '=' 賦值的變數名稱（還有 for 的迴圈變數）收集起來，一樣用堆疊走訪
+static void CollectAssignedNames(ExprAST *Root, std::set<std::string> &Names){
+    std::vector<ExprAST *> Work{Root};
+    while(!Work.empty()){
+        ExprAST *E = Work.back();
+        Work.pop_back();
+        if(!E){
+            continue;
+        }
+        if(auto *Bin = dynamic_cast<BinaryExprAST *>(E)){
+            if(Bin->getOp() == '='){
+                if(auto *Var = dynamic_cast<VariableExprAST *>(Bin->getLHS())){
+                    Names.insert(Var->getName());
+                }
+            }
+            Work.push_back(Bin->getLHS());
+            Work.push_back(Bin->getRHS());
+        } else if(auto *If = dynamic_cast<IfExprAST *>(E)){
+            Work.push_back(If->getCond());
+            Work.push_back(If->getThen());
+            Work.push_back(If->getElse());
+        } else if(auto *For = dynamic_cast<ForExprAST *>(E)){
+            Names.insert(For->getVarName());
+            Work.push_back(For->getStart());
+            Work.push_back(For->getEnd());
+            Work.push_back(For->getStep());
+            Work.push_back(For->getBody());
+        } else if(auto *Call = dynamic_cast<CallExprAST *>(E)){
+            for(auto &Arg : Call->getArgs()){
+                Work.push_back(Arg.get());
+            }
+        }
     }
-    CondV = Builder.CreateFCmpONE(CondV, llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)), "ifcond");
+}
 
+//整數而且小於 2^53 的 double，這種數字加減乘都不會有捨入誤差
+static bool IsExactInteger(ExprAST *E){
+    auto *Num = dynamic_cast<NumberExprAST *>(E);
+    return Num && std::trunc(Num->getVal()) == Num->getVal() && std::fabs(Num->getVal()) < 9007199254740992.0;
+}
 
-    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
-    llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(TheContext, "then", TheFunction);
-    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(TheContext, "else");
-    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(TheContext, "ifcont");
+//fast 模式下，像 for i = s, i < n, c in ... 這種迴圈
+//（s 是整數常數，c 是正的整數常數或省略，n 是數字或不會被改的變數，body 也不改 i）
+//可以先算出要跑幾次，用一個整數計數器 k 控制迴圈，i 則用 s + k*c 算出來。
+//double 的歸納變數配上會變的上限，LLVM 算不出迴圈次數，向量化就做不了；換成整數計數器之後就可以。
+//s 跟 c 都是整數，所以 s + k*c 跟「一直加 c」算出來的值完全一樣（在 2^53 以內），跑的次數也一樣。
+//像 0.1 這種步長一直加會累積誤差，次數可能跟 ceil(n / 0.1) 差一次，所以不做。
+//符合的話回傳上限那個表達式
+static ExprAST *GetCountedLoopBound(ForExprAST *E){
+    if(TheFPMode != FPMode::Fast){
+        return nullptr;
+    }
+    if(!IsExactInteger(E->getStart())){
+        return nullptr;
+    }
 
-    Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+    auto *Cmp = dynamic_cast<BinaryExprAST *>(E->getEnd());
+    if(!Cmp || Cmp->getOp() != '<'){
+        return nullptr;
+    }
+    auto *Var = dynamic_cast<VariableExprAST *>(Cmp->getLHS());
+    if(!Var || Var->getName() != E->getVarName()){
+        return nullptr;
+    }
 
-    Builder.SetInsertPoint(ThenBB);
-    llvm::Value *ThenV = Then->Codegen();
-    if(!ThenV){
+    if(E->getStep() && (!IsExactInteger(E->getStep()) || !(static_cast<NumberExprAST *>(E->getStep())->getVal() > 0))){
         return nullptr;
     }
-    Builder.CreateBr(MergeBB);
-    ThenBB = Builder.GetInsertBlock();
 
-    ElseBB->insertInto(TheFunction);
-    Builder.SetInsertPoint(ElseBB);
-    llvm::Value *ElseV = Else->Codegen();
-    if(!ElseV){
+    std::set<std::string> Assigned;
+    CollectAssignedNames(E->getBody(), Assigned);
+    if(Assigned.count(E->getVarName())){
         return nullptr;
     }
-    Builder.CreateBr(ElseBB);
-    ElseBB = Builder.GetInsertBlock();
 
-    MergeBB->insertInto(TheFunction);
-    Builder.SetInsertPoint(MergeBB);
-    llvm::PHINode *PN = Builder.CreatePHI(llvm::Type::getDoubleTy(TheContext), 2, "iftmp");
-    PN->addIncoming(ThenV, ThenBB);
-    PN->addIncoming(ElseV, ElseBB);
-    return PN;
+    ExprAST *Bound = Cmp->getRHS();
+    if(dynamic_cast<NumberExprAST *>(Bound)){
+        return Bound;
+    }
+    auto *BoundVar = dynamic_cast<VariableExprAST *>(Bound);
+    if(BoundVar && BoundVar->getName() != E->getVarName() && !Assigned.count(BoundVar->getName())){
+        return Bound;
+    }
+    return nullptr;
 }
 
-llvm::Value *CallExprAST::Codegen(){
-    llvm::Function *CalleeF = TheModule->getFunction(Callee);
-    if(!CalleeF){
-        return LogErrorV("Unknown function referenced!");
+//for：產生的迴圈長這樣，是 LLVM 迴圈最佳化喜歡的標準形狀
+//  preheader：算 start，存進迴圈變數，跳到 loop.cond
+//  loop.cond：算 end 條件，成立就進 loop.body，不然跳到 loop.exit（所以 end 一開始就不成立的話一次都不跑）
+//  loop.body：跑 body，然後進 loop.latch
+//  loop.latch：唯一一條跳回 loop.cond 的邊，在這裡把變數加上 step
+//迴圈變數是 alloca，mem2reg 之後就變成 loop.cond 裡的 phi。整個 for 的值固定是 0。
+//符合 GetCountedLoopBound 的迴圈，loop.cond 改成比較整數計數器跟事先算好的次數。
+static StepState StepFor(ForExprAST *E, CodegenFrame &F, ExprAST *&Child, llvm::Value *&Result){
+    const std::string &VarName = E->getVarName();
+    llvm::Type *DoubleTy = llvm::Type::getDoubleTy(TheContext);
+    llvm::Type *Int64Ty = llvm::Type::getInt64Ty(TheContext);
+    switch(F.Stage){
+        case 0:
+            F.Stage = 1;
+            Child = E->getStart();
+            return StepNeedChild;
+        case 1: {
+            llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+            F.Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+            Builder.CreateStore(F.Vals[0], F.Alloca);
+
+            //次數 = ceil((n - s) / c)，再確認 s + 次數*c 剛好是第一個 >= n 的值（除法的捨入可能讓它差一次），
+            //最後夾在 [0, 2^62] 之間，不然太大的次數轉成 i64 會變成 poison
+            if(ExprAST *Bound = GetCountedLoopBound(E)){
+                llvm::Value *BoundVal = Bound->Codegen();
+                if(!BoundVal){
+                    return StepError;
+                }
+                double StepConst = E->getStep() ? static_cast<NumberExprAST *>(E->getStep())->getVal() : 1.0;
+                llvm::Value *StepV = llvm::ConstantFP::get(TheContext, llvm::APFloat(StepConst));
+                llvm::Value *One = llvm::ConstantFP::get(TheContext, llvm::APFloat(1.0));
+                llvm::Value *Count = Builder.CreateFSub(BoundVal, F.Vals[0], "span");
+                Count = Builder.CreateFDiv(Count, StepV, "span");
+                Count = Builder.CreateUnaryIntrinsic(llvm::Intrinsic::ceil, Count);
+
+                llvm::Value *Last = Builder.CreateFAdd(F.Vals[0], Builder.CreateFMul(Count, StepV));
+                Count = Builder.CreateSelect(Builder.CreateFCmpOLT(Last, BoundVal), Builder.CreateFAdd(Count, One), Count);
+                llvm::Value *Prev = Builder.CreateFAdd(F.Vals[0], Builder.CreateFMul(Builder.CreateFSub(Count, One), StepV));
+                Count = Builder.CreateSelect(Builder.CreateFCmpOGE(Prev, BoundVal), Builder.CreateFSub(Count, One), Count);
+
+                Count = Builder.CreateBinaryIntrinsic(llvm::Intrinsic::maxnum, Count, llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)));
+                Count = Builder.CreateBinaryIntrinsic(llvm::Intrinsic::minnum, Count, llvm::ConstantFP::get(TheContext, llvm::APFloat(4611686018427387904.0)));
+                F.TripCount = Builder.CreateFPToSI(Count, Int64Ty, "tripcount");
+
+                llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+                F.Counter = TmpB.CreateAlloca(Int64Ty, nullptr, VarName + ".count");
+                Builder.CreateStore(llvm::ConstantInt::get(Int64Ty, 0), F.Counter);
+            }
+
+            F.Blocks[0] = llvm::BasicBlock::Create(TheContext, "loop.cond", TheFunction);
+            F.Blocks[1] = llvm::BasicBlock::Create(TheContext, "loop.body");
+            F.Blocks[2] = llvm::BasicBlock::Create(TheContext, "loop.latch");
+            F.Blocks[3] = llvm::BasicBlock::Create(TheContext, "loop.exit");
+            Builder.CreateBr(F.Blocks[0]);
+
+            //迴圈變數會蓋掉外面同名的變數，結束之後要還原
+            F.OldVal = NamedValues[VarName];
+            NamedValues[VarName] = F.Alloca;
+
+            Builder.SetInsertPoint(F.Blocks[0]);
+            if(!F.Counter){
+                F.Stage = 2;
+                Child = E->getEnd();
+                return StepNeedChild;
+            }
+
+            llvm::Value *Count = Builder.CreateLoad(Int64Ty, F.Counter, "count");
+            Builder.CreateCondBr(Builder.CreateICmpSLT(Count, F.TripCount, "loopcond"), F.Blocks[1], F.Blocks[3]);
+            F.Blocks[1]->insertInto(TheFunction);
+            Builder.SetInsertPoint(F.Blocks[1]);
+            F.Stage = 3;
+            Child = E->getBody();
+            return StepNeedChild;
+        }
+        case 2: {
+            llvm::Value *EndCond = Builder.CreateFCmpONE(F.Vals[1], llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)), "loopcond");
+            Builder.CreateCondBr(EndCond, F.Blocks[1], F.Blocks[3]);
+
+            F.Blocks[1]->insertInto(Builder.GetInsertBlock()->getParent());
+            Builder.SetInsertPoint(F.Blocks[1]);
+            F.Stage = 3;
+            Child = E->getBody();
+            return StepNeedChild;
+        }
+        case 3:
+            Builder.CreateBr(F.Blocks[2]);
+            F.Blocks[2]->insertInto(Builder.GetInsertBlock()->getParent());
+            Builder.SetInsertPoint(F.Blocks[2]);
+            F.Stage = 4;
+            if(!F.Counter && E->getStep()){
+                Child = E->getStep();
+                return StepNeedChild;
+            }
+            [[fallthrough]];
+        default: {
+            if(F.Counter){
+                double StepConst = E->getStep() ? static_cast<NumberExprAST *>(E->getStep())->getVal() : 1.0;
+                llvm::Value *Count = Builder.CreateLoad(Int64Ty, F.Counter, "count");
+                llvm::Value *NextCount = Builder.CreateAdd(Count, llvm::ConstantInt::get(Int64Ty, 1), "nextcount", true, true);
+                Builder.CreateStore(NextCount, F.Counter);
+                llvm::Value *Offset = Builder.CreateFMul(Builder.CreateSIToFP(NextCount, DoubleTy), llvm::ConstantFP::get(TheContext, llvm::APFloat(StepConst)));
+                Builder.CreateStore(Builder.CreateFAdd(F.Vals[0], Offset, "nextvar"), F.Alloca);
+            } else {
+                llvm::Value *StepVal = E->getStep() ? F.Vals.back() : llvm::ConstantFP::get(TheContext, llvm::APFloat(1.0));
+                llvm::Value *CurVar = Builder.CreateLoad(F.Alloca->getAllocatedType(), F.Alloca, VarName.c_str());
+                llvm::Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
+                Builder.CreateStore(NextVar, F.Alloca);
+            }
+            Builder.CreateBr(F.Blocks[0]);
+
+            F.Blocks[3]->insertInto(Builder.GetInsertBlock()->getParent());
+            Builder.SetInsertPoint(F.Blocks[3]);
+
+            if(F.OldVal){
+                NamedValues[VarName] = F.OldVal;
+            } else {
+                NamedValues.erase(VarName);
+            }
+
+            Result = llvm::Constant::getNullValue(DoubleTy);
+            return StepDone;
+        }
     }
+}
 
-    if(CalleeF->arg_size() != Args.size()){
-        return LogErrorV("Incorrect number of arguments passed!");
+//函數呼叫：先找函數、檢查參數個數，然後一個一個算參數，最後產生 call
+static StepState StepCall(CallExprAST *E, CodegenFrame &F, ExprAST *&Child, llvm::Value *&Result){
+    const auto &Args = E->getArgs();
+    if(F.Stage == 0){
+        F.Callee = getFunction(E->getCallee());
+        if(!F.Callee){
+            LogErrorV("Unknown function referenced!");
+            return StepError;
+        }
+        if(F.Callee->arg_size() != Args.size()){
+            LogErrorV("Incorrect number of arguments passed!");
+            return StepError;
+        }
+        F.Stage = 1;
     }
 
-    std::vector<llvm::Value *> ArgsV;
-    for(auto &Arg : Args){
-        llvm::Value *ArgV = Arg->Codegen();
-        if(!ArgV){
+    if(F.Vals.size() < Args.size()){
+        Child = Args[F.Vals.size()].get();
+        return StepNeedChild;
+    }
+
+    Result = Builder.CreateCall(F.Callee, F.Vals, "calltmp");
+    return StepDone;
+}
+
+static llvm::Value *CodegenExpr(ExprAST *Root){
+    std::vector<CodegenFrame> Stack;
+    Stack.emplace_back(Root);
+    llvm::Value *Result = nullptr;
+
+    while(true){
+        CodegenFrame &F = Stack.back();
+        ExprAST *Child = nullptr;
+        StepState State;
+
+        if(auto *Bin = dynamic_cast<BinaryExprAST *>(F.Node)){
+            State = StepBinary(Bin, F, Child, Result);
+        } else if(auto *If = dynamic_cast<IfExprAST *>(F.Node)){
+            State = StepIf(If, F, Child, Result);
+        } else if(auto *For = dynamic_cast<ForExprAST *>(F.Node)){
+            State = StepFor(For, F, Child, Result);
+        } else if(auto *Call = dynamic_cast<CallExprAST *>(F.Node)){
+            State = StepCall(Call, F, Child, Result);
+        } else {
+            Result = F.Node->Codegen();
+            State = Result ? StepDone : StepError;
+        }
+
+        if(State == StepError){
             return nullptr;
         }
-        ArgsV.push_back(ArgV);
+        if(State == StepNeedChild){
+            Stack.emplace_back(Child);
+            continue;
+        }
+
+        Stack.pop_back();
+        if(Stack.empty()){
+            return Result;
+        }
+        Stack.back().Vals.push_back(Result);
     }
+}
 
-    return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+llvm::Value *BinaryExprAST::Codegen(){
+    return CodegenExpr(this);
+}
+
+llvm::Value *IfExprAST::Codegen(){
+    return CodegenExpr(this);
+}
+
+llvm::Value *ForExprAST::Codegen(){
+    return CodegenExpr(this);
+}
+
+llvm::Value *CallExprAST::Codegen(){
+    return CodegenExpr(this);
 }
 
 llvm::Function *PrototypeAST::Codegen(){
@@ -159,26 +655,163 @@ llvm::Function *PrototypeAST::Codegen(){
     return F;
 }
 
+//依照浮點數模式設定 Builder 的 fast-math flags，之後這個函數裡產生的 fadd/fmul 都會帶上
+//fast 模式另外在函數上加屬性，讓後端也知道可以做不安全的最佳化
+static void ApplyFPMode(llvm::Function &F){
+    llvm::FastMathFlags FMF;
+    switch(TheFPMode){
+        case FPMode::Strict:
+            break;
+        case FPMode::Contract:
+            FMF.setAllowContract(true);
+            break;
+        case FPMode::Fast:
+            FMF.setFast();
+            F.addFnAttr("unsafe-fp-math", "true");
+            F.addFnAttr("no-infs-fp-math", "true");
+            F.addFnAttr("no-nans-fp-math", "true");
+            F.addFnAttr("no-signed-zeros-fp-math", "true");
+            break;
+    }
+    Builder.setFastMathFlags(FMF);
+}
+
+static bool IsPreludeCall(llvm::CallBase &CB){
+    llvm::Function *Callee = CB.getCalledFunction();
+    return Callee && PreludeNames.count(std::string(Callee->getName()));
+}
+
+//把 F 呼叫到的 prelude 函數 inline 進來
+//筆記：呼叫 prelude 函數的時候只會先產生一個宣告。prelude 模組是 lazy 載入的，
+//這裡先找出 F 用到（以及它們再呼叫到）的 prelude 函數，只 materialize 這幾個，
+//再用 CloneFunctionInto 直接把這幾個的本體複製進目前的模組並且改成 internal（每個模組各有一份，不會撞名）。
+//不用 Linker 是因為它每次都會掃過整個目前的模組，函數一多就會越來越慢。
+//然後把每個呼叫都 inline 掉，最後沒人用的 prelude 本體就刪掉。
+static void InlinePreludeCalls(llvm::Function &F){
+    if(!PreludeModule){
+        return;
+    }
+
+    std::vector<llvm::CallBase *> Calls;
+    std::vector<llvm::Function *> Pending;
+    for(auto &I : llvm::instructions(F)){
+        if(auto *CB = llvm::dyn_cast<llvm::CallBase>(&I)){
+            if(IsPreludeCall(*CB)){
+                Calls.push_back(CB);
+                Pending.push_back(PreludeModule->getFunction(CB->getCalledFunction()->getName()));
+            }
+        }
+    }
+    if(Calls.empty()){
+        return;
+    }
+
+    std::set<llvm::Function *> Seen;
+    std::vector<llvm::Function *> Needed;
+    while(!Pending.empty()){
+        llvm::Function *PF = Pending.back();
+        Pending.pop_back();
+        if(!PF || !Seen.insert(PF).second){
+            continue;
+        }
+        Needed.push_back(PF);
+        if(llvm::Error Err = PF->materialize()){
+            std::cerr << "Prelude Error: " << llvm::toString(std::move(Err)) << std::endl;
+            return;
+        }
+        for(auto &I : llvm::instructions(*PF)){
+            if(auto *CB = llvm::dyn_cast<llvm::CallBase>(&I)){
+                llvm::Function *Callee = CB->getCalledFunction();
+                if(Callee && !Callee->isDeclaration()){
+                    Pending.push_back(Callee);
+                }
+            }
+        }
+    }
+
+    //先在目前的模組替每個需要的函數準備好一個 internal 的函數（已經有宣告就直接用），
+    //這樣 prelude 函數互相呼叫的地方在複製的時候也會對應到目前模組裡的版本
+    llvm::ValueToValueMapTy VMap;
+    std::vector<llvm::Function *> ToClone;
+    for(auto *PF : Needed){
+        llvm::Function *Local = TheModule->getFunction(PF->getName());
+        if(!Local){
+            Local = llvm::Function::Create(PF->getFunctionType(), llvm::Function::InternalLinkage, PF->getName(), TheModule.get());
+        }
+        VMap[PF] = Local;
+        if(Local->isDeclaration()){
+            ToClone.push_back(PF);
+        }
+    }
+    for(auto *PF : ToClone){
+        auto *Local = llvm::cast<llvm::Function>(VMap[PF]);
+        auto LocalArg = Local->arg_begin();
+        for(auto &Arg : PF->args()){
+            LocalArg->setName(Arg.getName());
+            VMap[&Arg] = &*LocalArg++;
+        }
+        llvm::SmallVector<llvm::ReturnInst *, 8> Returns;
+        llvm::CloneFunctionInto(Local, PF, VMap, llvm::CloneFunctionChangeType::DifferentModule, Returns);
+        Local->setLinkage(llvm::Function::InternalLinkage);
+    }
+
+    for(auto *CB : Calls){
+        llvm::InlineFunctionInfo IFI;
+        llvm::InlineFunction(*CB, IFI);
+    }
+
+    for(auto &Name : PreludeNames){
+        llvm::Function *PF = TheModule->getFunction(Name);
+        if(PF && PF->hasLocalLinkage() && PF->use_empty()){
+            PF->eraseFromParent();
+        }
+    }
+}
+
+//筆記：原型要等函數本體產生完、驗證過之後才記進 FunctionProtos，
+//不然本體失敗的函數會留下一個沒有本體的宣告，之後呼叫它就會連到一個不存在的函數。
+//匿名的頂層表達式（名稱是空的）不記。
+//prelude 的函數可以被使用者用同樣的名字重新定義，之後呼叫這個名字就是用使用者的版本。
 llvm::Function *FunctionAST::Codegen(){
+    const std::string Name = Proto->getName();
+    if(FunctionProtos.count(Name)){
+        return (llvm::Function*)LogErrorV("Function cannot be redefined!");
+    }
+    if(PreludeNames.count(Name)){
+        //目前模組裡如果還留著同名的 prelude 宣告或本體，先改名讓出這個名字
+        if(llvm::Function *Old = TheModule->getFunction(Name)){
+            Old->setName(Name + ".prelude");
+        }
+    }
+
     llvm::Function *TheFunction = Proto->Codegen();
     if(!TheFunction){
         return nullptr;
     }
-
-    if(!TheFunction->empty()){
-        return (llvm::Function*)LogErrorV("Function cannot be redefined!");
-    }
     llvm::BasicBlock *BB = llvm::BasicBlock::Create(TheContext, "entry", TheFunction);
     Builder.SetInsertPoint(BB);
+    ApplyFPMode(*TheFunction);
 
     NamedValues.clear();
     for(auto &Arg : TheFunction->args()){
-        NamedValues[std::string(Arg.getName())] = &Arg;
+        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, std::string(Arg.getName()));
+        Builder.CreateStore(&Arg, Alloca);
+        NamedValues[std::string(Arg.getName())] = Alloca;
     }
 
     if (llvm::Value *RetVal = Body->Codegen()){
         Builder.CreateRet(RetVal);
-        llvm::verifyFunction(*TheFunction);
+        llvm::raw_os_ostream ErrOS(std::cerr);
+        if(llvm::verifyFunction(*TheFunction, &ErrOS)){
+            TheFunction->eraseFromParent();
+            return (llvm::Function*)LogErrorV("Generated function failed verification!");
+        }
+        InlinePreludeCalls(*TheFunction);
+        TheFPM->run(*TheFunction);
+        if(!Name.empty()){
+            FunctionProtos[Name] = std::move(Proto);
+            PreludeNames.erase(Name);
+        }
         return TheFunction;
     }
 
@@ -186,6 +819,44 @@ llvm::Function *FunctionAST::Codegen(){
     return nullptr;
 }
 
+//載入預先編好的標準函式庫（prelude/prelude.ray 在 build 的時候編成的 bitcode）
+//筆記：MemoryBuffer::getFile 會直接把檔案 mmap 進來，用 getOwningLazyBitcodeModule 解析成 lazy 的 PreludeModule，
+//這時候只讀了函數的宣告，本體要等 InlinePreludeCalls 用到的時候才 materialize，所以開程式不會多花時間。
+//每個函數的名稱都記進 PreludeNames，CallExprAST 用 getFunction 就找得到。
+static bool LoadPrelude(const std::string &Path){
+    auto BufOrErr = llvm::MemoryBuffer::getFile(Path);
+    if(!BufOrErr){
+        std::cerr << "Prelude Error: cannot open " << Path << ": " << BufOrErr.getError().message() << std::endl;
+        return false;
+    }
+
+    auto ModOrErr = llvm::getOwningLazyBitcodeModule(std::move(*BufOrErr), TheContext);
+    if(!ModOrErr){
+        std::cerr << "Prelude Error: " << llvm::toString(ModOrErr.takeError()) << std::endl;
+        return false;
+    }
+
+    PreludeModule = std::move(*ModOrErr);
+    for(auto &F : *PreludeModule){
+        if(!F.isDeclaration()){
+            PreludeNames.insert(std::string(F.getName()));
+        }
+    }
+    return true;
+}
+
+//把目前編好的所有函數寫成 bitcode，build 的時候用來產生 prelude.bc
+static bool EmitPrelude(const std::string &Path){
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+    if(EC){
+        std::cerr << "Prelude Error: cannot write " << Path << ": " << EC.message() << std::endl;
+        return false;
+    }
+    llvm::WriteBitcodeToFile(*TheModule, OS);
+    return true;
+}
+
 void HandleDefinition(){
     if(auto FnAST = ParseDefinition()){
         if(auto *FnIR = FnAST->Codegen()){
@@ -210,13 +881,12 @@ void HandleTopLevelExpression(){
     }
 }
 
-int main() {
-    InitializeCodegen();
+static void MainLoop(){
     while (true) {
       getNextTokenP();
       switch (CurTok) {
       case tok_eof:
-        return 0;
+        return;
       case tok_semicolon:
         getNextTokenP();
         break;
@@ -228,4 +898,242 @@ int main() {
         break;
       }
     }
-  }
\ No newline at end of file
+}
+
+//---------------------------------------------------------------------------------//
+//執行模式（--jobs=N）                                                               //
+//筆記：頂層表達式沒有副作用，所以不用一個一個跑。照原始碼的順序把 def 跟表達式編進同一個模組，   //
+//累積到一批（--batch）之後整個模組交給 MCJIT 編成機器碼，再把這一批的表達式丟給 N 條執行緒一起跑，//
+//跑完照原本的順序印出結果，然後換一個新模組繼續下一批。                                     //
+//表達式只能呼叫在它前面定義過的函數，而那些函數一定在同一批或更早的模組裡，                   //
+//所以開始跑之前它用到的定義都已經編好了。                                                //
+//---------------------------------------------------------------------------------//
+
+static bool AddModuleToEngine(){
+    if(TheEngine){
+        TheEngine->addModule(std::move(TheModule));
+        return true;
+    }
+
+    std::string Error;
+    llvm::EngineBuilder EB(std::move(TheModule));
+    EB.setEngineKind(llvm::EngineKind::JIT)
+      .setErrorStr(&Error)
+      .setMCPU(llvm::sys::getHostCPUName())
+      .setMAttrs(GetHostFeatures())
+      .setTargetOptions(GetTargetOptions());
+    TheEngine.reset(EB.create());
+    if(!TheEngine){
+        std::cerr << "JIT Error: " << Error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//編譯目前這一批，然後用 Jobs 條執行緒同時跑，每條執行緒自己去搶下一個還沒跑的表達式
+//一批裡面的一個位置：編好的表達式有函數名稱；
+//編譯失敗的表達式或定義沒有名稱，只留它的錯誤訊息，輸出的時候照原本的位置印出來
+struct BatchEntry {
+    std::string Name;
+    std::string Errors;
+};
+
+//編譯目前這一批，然後用 Jobs 條執行緒同時跑，每條執行緒自己去搶下一個還沒跑的表達式
+static bool RunBatch(const std::vector<BatchEntry> &Batch, unsigned Jobs){
+    if(!AddModuleToEngine()){
+        return false;
+    }
+    InitializeModule();
+
+    //拿不到位址的（JIT 編譯失敗）就不跑，輸出的時候在它的位置印錯誤
+    std::vector<double (*)()> Fns;
+    for(auto &Entry : Batch){
+        Fns.push_back(Entry.Name.empty() ? nullptr : (double (*)())TheEngine->getFunctionAddress(Entry.Name));
+    }
+
+    std::vector<double> Results(Fns.size());
+    std::atomic<size_t> Next{0};
+    auto Worker = [&]() {
+        for(size_t i = Next++; i < Fns.size(); i = Next++){
+            if(Fns[i]){
+                Results[i] = Fns[i]();
+            }
+        }
+    };
+
+    std::vector<std::thread> Pool;
+    unsigned NumThreads = std::min<size_t>(Jobs, Fns.size());
+    for(unsigned t = 1; t < NumThreads; ++t){
+        Pool.emplace_back(Worker);
+    }
+    Worker();
+    for(auto &T : Pool){
+        T.join();
+    }
+
+    for(size_t i = 0; i < Results.size(); ++i){
+        if(!Batch[i].Errors.empty()){
+            std::cout.flush();
+            std::cerr << Batch[i].Errors << std::flush;
+        }
+        if(Batch[i].Name.empty()){
+            continue;
+        }
+        if(!Fns[i]){
+            std::cout.flush();
+            std::cerr << "JIT Error: could not resolve " << Batch[i].Name << std::endl;
+            continue;
+        }
+        std::cout << "Evaluated to " << Results[i] << "\n";
+    }
+    std::cout.flush();
+    return true;
+}
+
+static int RunScript(unsigned Jobs, size_t BatchSize){
+    std::vector<BatchEntry> Batch;
+    size_t AnonCount = 0;
+
+    while(true){
+        getNextTokenP();
+        if(CurTok == tok_eof){
+            if(!Batch.empty() && !RunBatch(Batch, Jobs)){
+                return 1;
+            }
+            return 0;
+        }
+        if(CurTok == tok_semicolon){
+            continue;
+        }
+
+        //編譯的時候把 std::cerr 先導到字串裡，錯誤訊息才能等這一批跑完再照順序印
+        BatchEntry Entry;
+        std::ostringstream Captured;
+        std::streambuf *OldErr = std::cerr.rdbuf(Captured.rdbuf());
+        if(CurTok == tok_def){
+            if(auto FnAST = ParseDefinition()){
+                FnAST->Codegen();
+            } else {
+                getNextTokenP();
+            }
+        } else {
+            if(auto FnAST = ParseTopLevelExpr()){
+                if(auto *FnIR = FnAST->Codegen()){
+                    Entry.Name = "__anon_expr" + std::to_string(AnonCount++);
+                    FnIR->setName(Entry.Name);
+                }
+            } else {
+                getNextTokenP();
+            }
+        }
+        std::cerr.rdbuf(OldErr);
+        Entry.Errors = Captured.str();
+
+        if(!Entry.Name.empty() || !Entry.Errors.empty()){
+            Batch.push_back(std::move(Entry));
+        }
+        if(Batch.size() >= BatchSize){
+            if(!RunBatch(Batch, Jobs)){
+                return 1;
+            }
+            Batch.clear();
+        }
+    }
+}
+
+//解析 --jobs、--batch 後面的數字，只接受純十進位數字
+static bool ParseCount(const std::string &Str, unsigned long &Count){
+    if(Str.empty() || Str.size() > 9 || !std::all_of(Str.begin(), Str.end(), ::isdigit)){
+        return false;
+    }
+    Count = std::strtoul(Str.c_str(), nullptr, 10);
+    return true;
+}
+
+//預設的 prelude 位置
+//筆記：build 的時候可以用 -DRAY_PRELUDE_PATH=\"...\" 指定（例如安裝到別的地方的時候），
+//沒指定的話就找執行檔旁邊的 prelude.bc（make 會把它產生在跟 ray_compiler 同一個目錄），跟目前目錄無關。
+static std::string DefaultPreludePath(const char *Argv0){
+#ifdef RAY_PRELUDE_PATH
+    (void)Argv0;
+    return RAY_PRELUDE_PATH;
+#else
+    std::string Exe = llvm::sys::fs::getMainExecutable(Argv0, (void *)&DefaultPreludePath);
+    llvm::SmallString<256> Path(llvm::sys::path::parent_path(Exe));
+    llvm::sys::path::append(Path, "prelude.bc");
+    return std::string(Path.str());
+#endif
+}
+
+//用法：./ray_compiler [--fp-mode=strict|contract|fast] [--prelude=<path>|--no-prelude] < example.ray
+//      ./ray_compiler --jobs=N [--batch=M] < script.ray    （編譯並平行執行頂層表達式）
+//      ./ray_compiler --emit-prelude=prelude.bc < prelude/prelude.ray
+//沒有指定 --prelude 的時候會自動載入預設的 prelude.bc，位置見 DefaultPreludePath
+int main(int argc, char **argv) {
+    std::string PreludePath;
+    std::string EmitPath;
+    bool UsePrelude = true;
+    unsigned Jobs = 0;
+    size_t BatchSize = 1024;
+    for(int i = 1; i < argc; ++i){
+        std::string Arg = argv[i];
+        if(Arg.rfind("--fp-mode=", 0) == 0 && ParseFPMode(Arg.substr(10), TheFPMode)){
+            continue;
+        }
+        if(Arg.rfind("--prelude=", 0) == 0){
+            PreludePath = Arg.substr(10);
+            continue;
+        }
+        if(Arg == "--no-prelude"){
+            UsePrelude = false;
+            continue;
+        }
+        unsigned long Count;
+        if(Arg.rfind("--jobs=", 0) == 0 && ParseCount(Arg.substr(7), Count)){
+            Jobs = Count;
+            if(Jobs == 0){
+                Jobs = std::max(1u, std::thread::hardware_concurrency());
+            }
+            continue;
+        }
+        if(Arg.rfind("--batch=", 0) == 0 && ParseCount(Arg.substr(8), Count)){
+            BatchSize = std::max<size_t>(1, Count);
+            continue;
+        }
+        if(Arg.rfind("--emit-prelude=", 0) == 0){
+            EmitPath = Arg.substr(15);
+            continue;
+        }
+        std::cerr << "Unknown option: " << Arg << std::endl;
+        return 1;
+    }
+
+    InitializeCodegen();
+
+    if(EmitPath.empty() && UsePrelude){
+        if(!PreludePath.empty()){
+            if(!LoadPrelude(PreludePath)){
+                return 1;
+            }
+        } else {
+            std::string DefaultPath = DefaultPreludePath(argv[0]);
+            if(!llvm::sys::fs::exists(DefaultPath)){
+                std::cerr << "Warning: " << DefaultPath << " not found, running without prelude "
+                          << "(use --prelude=<path> or --no-prelude)" << std::endl;
+            } else if(!LoadPrelude(DefaultPath)){
+                return 1;
+            }
+        }
+    }
+
+    if(Jobs > 0 && EmitPath.empty()){
+        return RunScript(Jobs, BatchSize);
+    }
+
+    MainLoop();
+
+    if(!EmitPath.empty() && !EmitPrelude(EmitPath)){
+        return 1;
+    }
+    return 0;
+}
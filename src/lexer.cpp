@@ -25,6 +25,8 @@ int getNextToken() {
         if (IdentifierStr == "if") return tok_if;
         if (IdentifierStr == "then") return tok_then;
         if (IdentifierStr == "else") return tok_else;
+        if (IdentifierStr == "for") return tok_for;
+        if (IdentifierStr == "in") return tok_in;
         return tok_identifier;
     }
 
@@ -107,6 +109,12 @@ int getNextToken() {
 //             case tok_else:
 //                 std::cout << "Token: else" << std::endl;
 //                 break;
+//             case tok_for:
+//                 std::cout << "Token: for" << std::endl;
+//                 break;
+//             case tok_in:
+//                 std::cout << "Token: in" << std::endl;
+//                 break;
 //             case tok_identifier:
 //                 std::cout << "Token: identifier (" << IdentifierStr << ")" << std::endl;
 //                 break;
@@ -1,6 +1,7 @@
 #include"../include/lexer.h"
 #include"../include/ast.h"
-#include<map>
+#include<array>
+#include<vector>
 #include<memory>
 #include<iostream>
 
@@ -11,9 +12,26 @@ int getNextTokenP(){
     return CurTok;
 }
 
-static std::map<char, int> BinopPrecedence = {
-    {'=', 10}, {'>', 20}, {'+', 30}, {'-', 30}, {'*', 40}, {'/', 40}
-};
+//運算子優先級，直接用字元當索引查表，-1 表示不是二元運算子
+static const std::array<int, 256> BinopPrecedence = [] {
+    std::array<int, 256> Table;
+    Table.fill(-1);
+    Table['='] = 10;
+    Table['<'] = 20;
+    Table['>'] = 20;
+    Table['+'] = 30;
+    Table['-'] = 30;
+    Table['*'] = 40;
+    Table['/'] = 40;
+    return Table;
+}();
+
+static int GetTokPrecedence(){
+    if(CurTok != tok_operator){
+        return -1;
+    }
+    return BinopPrecedence[(unsigned char)CurrentOperator];
+}
 
 static std::unique_ptr<ExprAST> LogError(const char *Str) {
     std::cerr << "Error: " << Str << std::endl;
@@ -30,155 +48,227 @@ static std::unique_ptr<FunctionAST> LogErrorF(const char *Str) {
     return nullptr;
 };
 
-//前項聲明
-//筆記：就是先定義好，但是我先不告訴你這個東西是幹什麼用的
-static std::unique_ptr<ExprAST> ParseExpression();
-
-//數字解析
-//筆記：這就是標準解析數字做法，基本上呢，你就是會吃掉這個數字，然後創造一個<NumberExprAST>(數字) 的節點，然後繼續去吃下一個token
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
-    getNextTokenP();
-    return Result;
-};
-
-//解析括號表達式
-//筆記：這段基本上呢會先吃掉左括號，然後把後面的一整串吃成一個Expression樹，然後去吃吃看後面是不是右括號，如果不是就給個錯誤訊息，是就很完美了
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-    getNextTokenP();
-    auto V = ParseExpression();
-    if(!V){
-        return nullptr;
+//解析表達式時的一層「框」
+//筆記：每一層框都有自己的運算元堆疊、運算子堆疊跟括號深度，就是一個正在解析的子表達式。
+//函數呼叫的參數、if 的三段、for 的四段都是子表達式，遇到它們就推一層新的框上去，
+//子表達式結束之後把結果收進 Parts，再看下一個 token 決定要繼續解析下一段，還是把整個結構組起來交回上一層。
+//最外層的框是 Top，它的子表達式結束就是整個表達式結束。
+struct ParseFrame {
+    enum FrameKind { Top, Call, If, For } Kind;
+    std::string Name; //函數名稱或迴圈變數名稱
+    std::vector<std::unique_ptr<ExprAST>> Parts;
+    std::vector<std::unique_ptr<ExprAST>> Operands;
+    std::vector<char> Operators;
+    int ParenDepth = 0;
+
+    ParseFrame(FrameKind Kind, const std::string &Name = "") : Kind(Kind), Name(Name) {}
+
+    void Reduce(){
+        char Op = Operators.back();
+        Operators.pop_back();
+        auto RHS = std::move(Operands.back());
+        Operands.pop_back();
+        auto LHS = std::move(Operands.back());
+        Operands.pop_back();
+        Operands.push_back(std::make_unique<BinaryExprAST>(Op, std::move(LHS), std::move(RHS)));
     }
-    if(CurTok != tok_rparen){
-        return LogError("Expected ')' !");
+
+    //目前這個子表達式結束了，把剩下的運算子都合併掉
+    std::unique_ptr<ExprAST> Finish(){
+        if(ParenDepth > 0){
+            return LogError("Expected ')' !");
+        }
+        while(!Operators.empty()){
+            Reduce();
+        }
+        auto E = std::move(Operands.back());
+        Operands.clear();
+        return E;
     }
-    getNextTokenP();
-    return V;
 };
 
-//解析函數呼叫
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
-    getNextTokenP();
-
-    if(CurTok != tok_lparen){
-        return std::make_unique<VariableExprAST>(IdName);
-    }
+enum ConstructState { ConstructError, ConstructNeedMore, ConstructDone };
 
-    getNextTokenP();
-    std::vector<std::unique_ptr<ExprAST>> Args;
-    if(CurTok != tok_rparen){
-        while(true){
-            if(auto Arg = ParseExpression()){
-                Args.push_back(std::move(Arg));
-            } else {
-                return nullptr;
+//一個子表達式結束之後，依照框的種類決定下一步
+//需要下一段子表達式就回傳 ConstructNeedMore，整個結構組好了就放進 Result 回傳 ConstructDone
+static ConstructState ContinueConstruct(ParseFrame &F, std::unique_ptr<ExprAST> &Result){
+    switch(F.Kind){
+        case ParseFrame::Call:
+            if(CurTok == tok_comma){
+                getNextTokenP();
+                return ConstructNeedMore;
             }
-
-            if(CurTok == tok_rparen){
-                break;
-            } 
-
-            if(CurTok != tok_comma) {
-                return LogError("Expected ')' of ',' in argument list !");
+            if(CurTok != tok_rparen){
+                LogError("Expected ')' of ',' in argument list !");
+                return ConstructError;
             }
             getNextTokenP();
-        }
-    }
-    getNextTokenP();
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
-};
-
-//解析if 表達式
-static std::unique_ptr<ExprAST> ParseIfExpr(){
-    getNextTokenP();
-    auto Cond = ParseExpression();
-    if(!Cond){
-        return nullptr;
-    }
-
-    if(CurTok != tok_then){
-        return LogError("Expected 'then' !");
-    }
-    getNextTokenP();
-
-    auto Then = ParseExpression();
-    if(!Then){
-        return nullptr;
-    }
-
-    if(CurTok != tok_else){
-        return LogError("Expected 'else' !");
-    }
-    getNextTokenP();
-
-    auto Else = ParseExpression();
-    if(!Else){
-        return nullptr;
-    }
-
-    return std::make_unique<IfExprAST>(std::move(Cond),std::move(Then),std::move(Else));
-
-}
+            Result = std::make_unique<CallExprAST>(F.Name, std::move(F.Parts));
+            return ConstructDone;
+
+        case ParseFrame::If:
+            if(F.Parts.size() == 1){
+                if(CurTok != tok_then){
+                    LogError("Expected 'then' !");
+                    return ConstructError;
+                }
+                getNextTokenP();
+                return ConstructNeedMore;
+            }
+            if(F.Parts.size() == 2){
+                if(CurTok != tok_else){
+                    LogError("Expected 'else' !");
+                    return ConstructError;
+                }
+                getNextTokenP();
+                return ConstructNeedMore;
+            }
+            Result = std::make_unique<IfExprAST>(std::move(F.Parts[0]), std::move(F.Parts[1]), std::move(F.Parts[2]));
+            return ConstructDone;
+
+        case ParseFrame::For:
+            //Parts 依序是 start、end、step（沒寫的話是 nullptr）、body
+            if(F.Parts.size() == 1){
+                if(CurTok != tok_comma){
+                    LogError("Expected ',' after for start value !");
+                    return ConstructError;
+                }
+                getNextTokenP();
+                return ConstructNeedMore;
+            }
+            if(F.Parts.size() == 2 && CurTok == tok_comma){
+                getNextTokenP();
+                return ConstructNeedMore;
+            }
+            if(F.Parts.size() == 2 || F.Parts.size() == 3){
+                if(F.Parts.size() == 2){
+                    F.Parts.push_back(nullptr);
+                }
+                if(CurTok != tok_in){
+                    LogError("Expected 'in' after for !");
+                    return ConstructError;
+                }
+                getNextTokenP();
+                return ConstructNeedMore;
+            }
+            Result = std::make_unique<ForExprAST>(F.Name, std::move(F.Parts[0]), std::move(F.Parts[1]),
+                                                  std::move(F.Parts[2]), std::move(F.Parts[3]));
+            return ConstructDone;
 
-//解析一些簡單的基礎表達
-static std::unique_ptr<ExprAST> ParsePrimary(){
-    switch(CurTok){
-        case tok_identifier:
-            return ParseIdentifierExpr();
-        case tok_number:
-            return ParseNumberExpr();
-        case tok_lparen:
-            return ParseParenExpr();
-        case tok_if:
-            return ParseIfExpr();
         default:
-            return LogError("unknown token when expecting an expression!");
+            return ConstructError;
     }
 }
 
-//解析二元運算
-//筆記：這個函數有點複雜，基本上是這樣，這個函數會先把一坨已經處理好的東西扔進函數裡，然後看現在的token是不是運算子，
-//然後看這個運算子的優先級有沒有比較高，如果有的話，那就表示結束了，不用繼續解析判斷了，就回傳LHS，
-//如果更高，我就吃掉這個，解析右邊的，然後繼續檢查右邊有沒有更更高的，然後把右邊的處理完之後，
-//在跟原本的左邊結合在一起，塞進左邊已經處理好了的，開始新一輪。
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS){
+//解析表達式
+//筆記：這裡整個都不用遞迴。二元運算用的是 shunting-yard：
+//每吃到一個運算子，就先把堆疊上優先級大於等於它的運算子拿出來跟兩個運算元合併（所以是左結合），再把自己放上去。
+//左括號直接放進運算子堆疊當作分隔，遇到右括號就一路合併到左括號為止。
+//函數呼叫、if、for 這些裡面還有子表達式的，就推一層 ParseFrame（見上面），不會呼叫自己。
+//這樣不管巢狀得多深，花的時間跟記憶體都只跟輸入長度成正比，也不會把堆疊撐爆。
+static std::unique_ptr<ExprAST> ParseExpression() {
+    std::vector<ParseFrame> Stack;
+    Stack.emplace_back(ParseFrame::Top);
+    std::unique_ptr<ExprAST> Operand;
+
     while(true){
-        int TokPrec = (CurTok == tok_operator)? BinopPrecedence[CurrentOperator] : -1;
+        //還沒有運算元的話，先吃掉左括號，然後解析一個基礎表達
+        if(!Operand){
+            ParseFrame &F = Stack.back();
+            while(CurTok == tok_lparen){
+                F.Operators.push_back('(');
+                ++F.ParenDepth;
+                getNextTokenP();
+            }
 
-        if(TokPrec < ExprPrec){
-            return LHS;
+            switch(CurTok){
+                case tok_number:
+                    Operand = std::make_unique<NumberExprAST>(NumVal);
+                    getNextTokenP();
+                    break;
+                case tok_identifier: {
+                    std::string IdName = IdentifierStr;
+                    getNextTokenP();
+                    if(CurTok != tok_lparen){
+                        Operand = std::make_unique<VariableExprAST>(IdName);
+                        break;
+                    }
+                    getNextTokenP();
+                    if(CurTok == tok_rparen){
+                        getNextTokenP();
+                        Operand = std::make_unique<CallExprAST>(IdName, std::vector<std::unique_ptr<ExprAST>>());
+                        break;
+                    }
+                    Stack.emplace_back(ParseFrame::Call, IdName);
+                    continue;
+                }
+                case tok_if:
+                    getNextTokenP();
+                    Stack.emplace_back(ParseFrame::If);
+                    continue;
+                case tok_for: {
+                    getNextTokenP();
+                    if(CurTok != tok_identifier){
+                        return LogError("Expected identifier after 'for' !");
+                    }
+                    std::string IdName = IdentifierStr;
+                    getNextTokenP();
+                    if(CurTok != tok_operator || CurrentOperator != '='){
+                        return LogError("Expected '=' after for !");
+                    }
+                    getNextTokenP();
+                    Stack.emplace_back(ParseFrame::For, IdName);
+                    continue;
+                }
+                default:
+                    return LogError("unknown token when expecting an expression!");
+            }
         }
 
-        char BinOp = CurrentOperator;
-        getNextTokenP();
+        ParseFrame &F = Stack.back();
+        F.Operands.push_back(std::move(Operand));
 
-        auto RHS = ParsePrimary();
-        if(!RHS){
-            return nullptr;
+        //右括號只有在這一層開過括號的時候才吃，不然就是外面（例如函數參數）的右括號
+        while(CurTok == tok_rparen && F.ParenDepth > 0){
+            while(F.Operators.back() != '('){
+                F.Reduce();
+            }
+            F.Operators.pop_back();
+            --F.ParenDepth;
+            getNextTokenP();
         }
 
-        int NextTok = (CurTok == tok_operator)? BinopPrecedence[CurrentOperator] : -1;
-        if(TokPrec < NextTok){
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-            if(!RHS){
-                return nullptr;
+        int TokPrec = GetTokPrecedence();
+        if(TokPrec >= 0){
+            while(!F.Operators.empty() && F.Operators.back() != '(' && BinopPrecedence[(unsigned char)F.Operators.back()] >= TokPrec){
+                F.Reduce();
             }
+            F.Operators.push_back(CurrentOperator);
+            getNextTokenP();
+            continue;
         }
 
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
-    }
-}
+        //這一層的子表達式結束了
+        auto E = F.Finish();
+        if(!E){
+            return nullptr;
+        }
+        if(Stack.size() == 1){
+            return E;
+        }
 
-// 解析基本表達
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParsePrimary();
-    if(!LHS){
-        return nullptr;
+        F.Parts.push_back(std::move(E));
+        switch(ContinueConstruct(F, Operand)){
+            case ConstructError:
+                return nullptr;
+            case ConstructNeedMore:
+                break;
+            case ConstructDone:
+                //組好的結構就是上一層的一個運算元
+                Stack.pop_back();
+                break;
+        }
     }
-
-    return ParseBinOpRHS(0, std::move(LHS));
 }
 
 // 解析函數的定義那一行（函數原型）
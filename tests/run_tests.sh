@@ -0,0 +1,81 @@
+#!/bin/sh
+# run_tests.sh - 跑 tests/ 底下的 .ray 測試
+# 用法：tests/run_tests.sh [ray_compiler 的路徑]   （預設是 ./ray_compiler，要先 make 好，prelude.bc 也要在旁邊）
+#
+# 每個 .ray 檔案裡面用註解寫要怎麼跑、要檢查什麼：
+#   # RUN: <參數>        用這些參數跑一次 ray_compiler（可以寫好幾行，每一次都要通過下面的檢查）
+#   # CHECK: <文字>      輸出（stdout 跟 stderr 合在一起）裡要依序出現這些文字
+#   # CHECK-NOT: <文字>  輸出裡不能出現這段文字
+# 如果旁邊有同名的 .expected 檔案，輸出要跟它一模一樣。
+
+COMPILER=${1:-./ray_compiler}
+TESTDIR=$(dirname "$0")
+PASS=0
+FAIL=0
+
+for TEST in "$TESTDIR"/*.ray; do
+    NAME=$(basename "$TEST" .ray)
+    EXPECTED="$TESTDIR/$NAME.expected"
+    OK=1
+
+    RUNS=$(sed -n 's/^# RUN: *//p' "$TEST")
+    if [ -z "$RUNS" ]; then
+        RUNS=" "
+    fi
+
+    # 一行一個 RUN，用換行切開
+    OLDIFS=$IFS
+    IFS='
+'
+    for ARGS in $RUNS; do
+        IFS=$OLDIFS
+        # shellcheck disable=SC2086
+        OUTPUT=$("$COMPILER" $ARGS < "$TEST" 2>&1)
+
+        if [ -f "$EXPECTED" ] && [ "$OUTPUT" != "$(cat "$EXPECTED")" ]; then
+            echo "FAIL: $NAME [$ARGS] output differs from $NAME.expected"
+            printf '%s\n' "$OUTPUT" | diff "$EXPECTED" - | head -20
+            OK=0
+        fi
+
+        REST=$OUTPUT
+        while IFS= read -r LINE; do
+            case "$LINE" in
+            "# CHECK: "*)
+                PATTERN=${LINE#"# CHECK: "}
+                case "$REST" in
+                *"$PATTERN"*)
+                    REST=${REST#*"$PATTERN"}
+                    ;;
+                *)
+                    echo "FAIL: $NAME [$ARGS] expected '$PATTERN'"
+                    OK=0
+                    ;;
+                esac
+                ;;
+            "# CHECK-NOT: "*)
+                PATTERN=${LINE#"# CHECK-NOT: "}
+                case "$OUTPUT" in
+                *"$PATTERN"*)
+                    echo "FAIL: $NAME [$ARGS] unexpected '$PATTERN'"
+                    OK=0
+                    ;;
+                esac
+                ;;
+            esac
+        done < "$TEST"
+        IFS='
+'
+    done
+    IFS=$OLDIFS
+
+    if [ $OK -eq 1 ]; then
+        echo "PASS: $NAME"
+        PASS=$((PASS + 1))
+    else
+        FAIL=$((FAIL + 1))
+    fi
+done
+
+echo "$PASS passed, $FAIL failed"
+[ $FAIL -eq 0 ]